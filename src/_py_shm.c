@@ -2,6 +2,13 @@
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #define INT_CONVERT_FAILURE    -999  
 #define GET_FAILURE            -998 
@@ -9,9 +16,40 @@
 #define GET_ITEM_FAILURE       -996 
 #define FLOAT_CONVERT_FAILURE  -995 
 #define PYLONG_CONVERT_FAILURE -994 
+#define ALLOC_FAILURE          -993
+#define THREAD_FAILURE         -992
+#define STAT_FAILURE           -991
+#define OFFSET_FAILURE         -990
+#define OPEN_FAILURE           -989
+#define MAP_FAILURE            -988
+#define LOST_FAILURE           -987
+
+/* parameters of the radix sort used to order frames by key columns. Keys are sorted
+   RADIX_BITS at a time; chunks smaller than MIN_SORT_CHUNK are not worth a thread */
+#define RADIX_BITS     8
+#define RADIX_BUCKETS  (1 << RADIX_BITS)
+#define RADIX_PASSES   (64 / RADIX_BITS)
+#define MIN_SORT_CHUNK 65536
+#define SIGN_BIT       ((uint64_t) 1 << 63)
+
+/* constants of the content hash used to recognize columns which are already in shared memory.
+   Each 8 byte element is mixed into the hash as in MurmurHash3 */
+#define HASH_SEED      0x9E3779B97F4A7C15ULL
+#define HASH_PRIME1    0x87C37B91114253D5ULL
+#define HASH_PRIME2    0x4CF5AD432745937FULL
 
 typedef enum datatypes {INTEGER, DOUBLE, PYLONG} DTYPE;
 
+/* the slice of a radix sort pass handled by a single thread. "counts" holds the digit histogram
+   of the slice and is then overwritten with the position each digit is scattered to */
+typedef struct SortChunk {
+    uint64_t *keys, *keys_out;
+    long     *perm, *perm_out;
+    long     lo, hi;
+    int      shift;
+    long     counts[RADIX_BUCKETS];
+} SortChunk;
+
 /* access functions - these get an element of a Python list and
    convert it to a C type. If an error is encountered they set "err_flag" to 1
    and return a numeric code indicating the source of the error */
@@ -23,33 +61,74 @@ static double get_PyLong_elt(PyObject *list, int idx, int *err_flag);
    upon success they return the segment_id to which data was written
    upon error the return a negative integer indicating the source of 
    the error */
-static int write_integer_list(PyObject *list, key_t key);
-static int write_double_list(PyObject  *list, key_t key);
-static int write_PyLong_list(PyObject  *list, key_t key);
+static int write_integer_list(PyObject *list, key_t key, long *perm, uint64_t *hash);
+static int write_double_list(PyObject  *list, key_t key, long *perm, uint64_t *hash);
+static int write_PyLong_list(PyObject  *list, key_t key, long *perm, uint64_t *hash);
+
+/* hashing - these compute the content hash of a list as it would be written to shared memory.
+   The writers above, and copy_list below, compute the same hash as they copy */
+static uint64_t hash_word(uint64_t hash, uint64_t word);
+static uint64_t hash_double(uint64_t hash, double elt);
+static uint64_t hash_finish(uint64_t hash, int numel);
+
+/* updaters - these write a Python list into an existing segment, reallocating the segment
+   under the same key if it is too small. Upon success they return the segment_id (which
+   changes if the segment is reallocated), upon error a negative integer */
+static int update_segment(PyObject *list, long dtype, key_t key, long offset);
+static int restore_segment(key_t key, size_t size, char *saved, size_t nbytes);
+static int copy_list(PyObject *list, long dtype, long *perm, char *dest, uint64_t *hash);
+
+/* file writers - these write a Python list into a memory mapped file with the layout of a
+   shared memory segment. Upon error they return a negative integer */
+static int write_file_list(PyObject *list, long dtype, const char *path, long offset, long *perm,
+                           uint64_t *hash);
+
+/* sorting - these compute the permutation that orders a set of key lists. Keys are mapped to
+   unsigned integers with the same ordering and sorted with a stable, multithreaded LSD radix
+   sort. Upon error they return a negative integer indicating the source of the error */
+static int extract_sort_keys(PyObject *list, long dtype, long *perm, uint64_t *keys, long numel);
+static int radix_sort(uint64_t *keys, long *perm, long numel, int num_threads);
+static int run_sort_threads(void *(*routine)(void *), SortChunk *chunks, int num_threads);
+static void *radix_histogram(void *thread_args);
+static void *radix_scatter(void *thread_args);
+static uint64_t order_long(long elt);
+static uint64_t order_double(double elt);
 
 // utility functions
 static int len(PyObject *list);
+static long *get_permutation(PyObject *perm_list, int numel);
+static PyObject *set_write_error(int exit_status);
 
 // main function: calls writers, handles exceptions
 static PyObject *_py_shm(PyObject *self, PyObject *args)
 {
-    PyObject *datalist, *outlist;
+    PyObject *datalist, *outlist, *perm_list;
     key_t key;
     int segment_id, exit_status;
-    long dtype, key_seed;
+    long dtype, key_seed, *perm;
+    uint64_t hash;
 
     /* interpret arguments passed from Python. Explanation:
            [0]: O!: Pointer to a Python object (a list) to be written to shared memory
            [1]: l:  Python integer -> C long with the data type of 0
-           [2]: l:  Python integer -> C long with the byte used to seed ftok */
+           [2]: l:  Python integer -> C long with the byte used to seed ftok
+           [3]: O!: (optional) a list of indices giving the order in which to write 0 */
     
-    if (!PyArg_ParseTuple(args, "O!ll", &PyList_Type, &datalist, &dtype, &key_seed))
+    perm_list = NULL;
+    if (!PyArg_ParseTuple(args, "O!ll|O!", &PyList_Type, &datalist, &dtype, &key_seed,
+                          &PyList_Type, &perm_list))
+        return NULL;
+
+    perm = NULL;
+    if (perm_list != NULL && (perm = get_permutation(perm_list, len(datalist))) == NULL)
         return NULL;
 
     // obtain a key to generate a shared memory segment
-    if ((key = ftok("/tmp", (int) key_seed)) == (key_t) -1)
+    if ((key = ftok("/tmp", (int) key_seed)) == (key_t) -1) {
+        free(perm);
         return PyErr_Format(PyExc_OSError, 
             "Could not create new key. OS Returned Error %d: %s", errno, strerror(errno));
+    }
 
     segment_id = 0;
     
@@ -57,53 +136,34 @@ static PyObject *_py_shm(PyObject *self, PyObject *args)
        caught in Python. */
     switch (dtype) {
         case INTEGER:
-            exit_status = write_integer_list(datalist, key);
+            exit_status = write_integer_list(datalist, key, perm, &hash);
             break;
         case DOUBLE:
-            exit_status = write_double_list(datalist, key);
+            exit_status = write_double_list(datalist, key, perm, &hash);
             break;
         case PYLONG:
-            exit_status = write_PyLong_list(datalist, key);
+            exit_status = write_PyLong_list(datalist, key, perm, &hash);
             break;
         default:
+            free(perm);
             PyErr_SetString(PyExc_TypeError, "Unsupported datatype passed");
             return NULL;
     }
+    free(perm);
 
     /* handle the exit codes from writer functions. The exit status is either a 
        code indicating which function call failed or the segment ID of allocated memory */
-    switch (exit_status) {
-        case INT_CONVERT_FAILURE:
-            PyErr_SetString(PyExc_TypeError, "Could not cast to integer");
-            return NULL;
-        case FLOAT_CONVERT_FAILURE:
-            PyErr_SetString(PyExc_TypeError, "Could not cast to double from PyFloat");
-            return NULL;
-        case PYLONG_CONVERT_FAILURE:
-            PyErr_SetString(PyExc_TypeError, "Could not cast to double from PyLong");
-            return NULL;
-        case GET_FAILURE:
-            return PyErr_Format(PyExc_OSError, 
-                "Could not create segment. OS Returned Error %d: %s", errno, strerror(errno));
-        case ATT_FAILURE:
-            return PyErr_Format(PyExc_OSError,
-                "Could not attach segment. OS Returned Error %d: %s", errno, strerror(errno));
-        case GET_ITEM_FAILURE:
-            PyErr_SetString(PyExc_StandardError, "Error extracting item");
-            return NULL;
-    }
-    if (exit_status < 0) {
-        PyErr_SetString(PyExc_StandardError, "Undefined error occurred");
-        return NULL;
-    }
+    if (exit_status < 0)
+        return set_write_error(exit_status);
     segment_id = exit_status; // functions return segment IDs upon success
     
     /* build the return value of the program. The function will return a list
        containing:
-           [0] the key associated with the written segment and 
-           [2] the segment ID associated with the written segment  */
+           [0] the key associated with the written segment,
+           [1] the segment ID associated with the written segment and
+           [2] the content hash of the written segment */
 
-    outlist = PyList_New(2);
+    outlist = PyList_New(3);
     if (PyList_SetItem(outlist, 0, PyInt_FromLong((long) key))) {
         PyErr_SetString(PyExc_StandardError, "Error setting item");
         Py_DECREF(outlist);
@@ -114,12 +174,295 @@ static PyObject *_py_shm(PyObject *self, PyObject *args)
         Py_DECREF(outlist);
         return NULL;
     }
+    if (PyList_SetItem(outlist, 2, PyLong_FromUnsignedLongLong(hash))) {
+        PyErr_SetString(PyExc_StandardError, "Error setting item");
+        Py_DECREF(outlist);
+        return NULL;
+    }
     return Py_BuildValue("O", outlist);
 }
 
+// hash function: computes the content hash "write" would return without writing
+static PyObject *_py_hash(PyObject *self, PyObject *args)
+{
+    PyObject *datalist, *perm_list;
+    long dtype, *perm;
+    int exit_status;
+    uint64_t hash;
+
+    /* interpret arguments passed from Python. Explanation:
+           [0]: O!: Pointer to a Python object (a list) to be hashed
+           [1]: l:  Python integer -> C long with the data type of 0
+           [2]: O!: (optional) a list of indices giving the order in which to hash 0 */
+
+    perm_list = NULL;
+    if (!PyArg_ParseTuple(args, "O!l|O!", &PyList_Type, &datalist, &dtype,
+                          &PyList_Type, &perm_list))
+        return NULL;
+
+    if (dtype != INTEGER && dtype != DOUBLE && dtype != PYLONG) {
+        PyErr_SetString(PyExc_TypeError, "Unsupported datatype passed");
+        return NULL;
+    }
+
+    perm = NULL;
+    if (perm_list != NULL && (perm = get_permutation(perm_list, len(datalist))) == NULL)
+        return NULL;
+    exit_status = copy_list(datalist, dtype, perm, NULL, &hash);
+    free(perm);
+
+    if (exit_status < 0)
+        return set_write_error(exit_status);
+    return PyLong_FromUnsignedLongLong(hash);
+}
+
+/* read function: returns a list of the first "numel" elements of the segment with a given key,
+   which must hold C doubles */
+static PyObject *_py_read(PyObject *self, PyObject *args)
+{
+    PyObject *outlist;
+    long key, numel, idx;
+    int segment_id;
+    double *shm;
+
+    if (!PyArg_ParseTuple(args, "ll", &key, &numel))
+        return NULL;
+    if (numel < 0) {
+        PyErr_SetString(PyExc_ValueError, "Number of elements must be non-negative");
+        return NULL;
+    }
+
+    if ((segment_id = shmget((key_t) key, numel * sizeof(double), S_IRUSR)) == -1)
+        return set_write_error(GET_FAILURE);
+    if ((shm = shmat(segment_id, 0, SHM_RDONLY)) == (void *) -1)
+        return set_write_error(ATT_FAILURE);
+
+    if ((outlist = PyList_New(numel)) == NULL) {
+        shmdt(shm);
+        return NULL;
+    }
+    for (idx = 0; idx < numel; idx++)
+        PyList_SET_ITEM(outlist, idx, PyFloat_FromDouble(shm[idx]));
+
+    // detach (but do not deallocate) the segment
+    shmdt(shm);
+    return outlist;
+}
+
+// file function: writes a list to a file instead of shared memory, handles exceptions
+static PyObject *_py_write_file(PyObject *self, PyObject *args)
+{
+    PyObject *datalist, *perm_list;
+    long dtype, offset, *perm;
+    const char *path;
+    int exit_status;
+    uint64_t hash;
+
+    /* interpret arguments passed from Python. Explanation:
+           [0]: O!: Pointer to a Python object (a list) to be written to the file
+           [1]: l:  Python integer -> C long with the data type of 0
+           [2]: s:  Python string -> the path of the file
+           [3]: l:  Python integer -> C long with the byte offset in the file at which to write 0
+           [4]: O!: (optional) a list of indices giving the order in which to write 0 */
+
+    perm_list = NULL;
+    if (!PyArg_ParseTuple(args, "O!lsl|O!", &PyList_Type, &datalist, &dtype, &path, &offset,
+                          &PyList_Type, &perm_list))
+        return NULL;
+
+    if (dtype != INTEGER && dtype != DOUBLE && dtype != PYLONG) {
+        PyErr_SetString(PyExc_TypeError, "Unsupported datatype passed");
+        return NULL;
+    }
+
+    perm = NULL;
+    if (perm_list != NULL && (perm = get_permutation(perm_list, len(datalist))) == NULL)
+        return NULL;
+    exit_status = write_file_list(datalist, dtype, path, offset, perm, &hash);
+    free(perm);
+
+    // return the content hash of the written list, as "write" does
+    if (exit_status < 0)
+        return set_write_error(exit_status);
+    return PyLong_FromUnsignedLongLong(hash);
+}
+
+// key function: returns the key "write" obtains from a seed
+static PyObject *_py_key(PyObject *self, PyObject *args)
+{
+    long key_seed;
+    key_t key;
+
+    if (!PyArg_ParseTuple(args, "l", &key_seed))
+        return NULL;
+    if ((key = ftok("/tmp", (int) key_seed)) == (key_t) -1)
+        return PyErr_Format(PyExc_OSError, 
+            "Could not create new key. OS Returned Error %d: %s", errno, strerror(errno));
+    return PyInt_FromLong((long) key);
+}
+
+/* stat function: returns a list containing the segment ID and size in bytes of the segment
+   with a given key, or None if there is no such segment */
+static PyObject *_py_stat(PyObject *self, PyObject *args)
+{
+    long key;
+    int segment_id;
+    struct shmid_ds segment_stats;
+
+    if (!PyArg_ParseTuple(args, "l", &key))
+        return NULL;
+    if ((segment_id = shmget((key_t) key, 0, S_IRUSR | S_IWUSR)) == -1) {
+        if (errno == ENOENT)
+            Py_RETURN_NONE;
+        return set_write_error(GET_FAILURE);
+    }
+    if (shmctl(segment_id, IPC_STAT, &segment_stats) == -1)
+        return set_write_error(STAT_FAILURE);
+    return Py_BuildValue("[ll]", (long) segment_id, (long) segment_stats.shm_segsz);
+}
+
+// update function: writes a list into an existing segment, handles exceptions
+static PyObject *_py_update(PyObject *self, PyObject *args)
+{
+    PyObject *datalist;
+    long dtype, key, offset;
+    int exit_status;
+
+    /* interpret arguments passed from Python. Explanation:
+           [0]: O!: Pointer to a Python object (a list) to be written to shared memory
+           [1]: l:  Python integer -> C long with the data type of 0
+           [2]: l:  Python integer -> C long with the key of the existing segment
+           [3]: l:  Python integer -> C long with the element at which to start writing 0 */
+
+    if (!PyArg_ParseTuple(args, "O!lll", &PyList_Type, &datalist, &dtype, &key, &offset))
+        return NULL;
+
+    if (dtype != INTEGER && dtype != DOUBLE && dtype != PYLONG) {
+        PyErr_SetString(PyExc_TypeError, "Unsupported datatype passed");
+        return NULL;
+    }
+    if (offset < 0) {
+        PyErr_SetString(PyExc_ValueError, "Offset must be non-negative");
+        return NULL;
+    }
+
+    if ((exit_status = update_segment(datalist, dtype, (key_t) key, offset)) < 0)
+        return set_write_error(exit_status);
+
+    // return the key and the (possibly new) segment ID, as "write" does
+    return Py_BuildValue("[ll]", key, (long) exit_status);
+}
+
+// compute the permutation that sorts a set of key lists, handles exceptions
+static PyObject *_py_sort(PyObject *self, PyObject *args)
+{
+    PyObject *keylists, *dtypes, *outlist, *item;
+    uint64_t *keys;
+    long *perm, dtype, num_threads, numel, idx;
+    int nkeys, k, exit_status;
+
+    /* interpret arguments passed from Python. Explanation:
+           [0]: O!: a list of key lists, the first being the most significant
+           [1]: O!: a list with the data type of each key list
+           [2]: l:  (optional) the number of threads to sort with. 0 uses every online CPU */
+
+    num_threads = 0;
+    if (!PyArg_ParseTuple(args, "O!O!|l", &PyList_Type, &keylists, &PyList_Type, &dtypes,
+                          &num_threads))
+        return NULL;
+
+    nkeys = len(keylists);
+    if (nkeys < 1 || nkeys != len(dtypes)) {
+        PyErr_SetString(PyExc_ValueError, "Expected one data type for each key list");
+        return NULL;
+    }
+    numel = len(PyList_GetItem(keylists, 0));
+    for (k = 0; k < nkeys; k++) {
+        item = PyList_GetItem(keylists, k);
+        if (!PyList_Check(item) || len(item) != numel) {
+            PyErr_SetString(PyExc_ValueError, "Key lists must be lists of equal length");
+            return NULL;
+        }
+    }
+    if (num_threads < 1)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = 1;
+
+    keys = malloc((numel > 0 ? numel : 1) * sizeof(uint64_t));
+    perm = malloc((numel > 0 ? numel : 1) * sizeof(long));
+    if (keys == NULL || perm == NULL) {
+        free(keys);
+        free(perm);
+        return PyErr_NoMemory();
+    }
+    for (idx = 0; idx < numel; idx++)
+        perm[idx] = idx;
+
+    /* a stable sort on each key from least to most significant leaves the rows ordered by
+       all keys. The GIL is released while the (pure C) sort runs */
+    exit_status = 0;
+    for (k = nkeys - 1; k >= 0 && exit_status == 0; k--) {
+        dtype = PyInt_AsLong(PyList_GetItem(dtypes, k));
+        exit_status = extract_sort_keys(PyList_GetItem(keylists, k), dtype, perm, keys, numel);
+        if (exit_status != 0)
+            break;
+        Py_BEGIN_ALLOW_THREADS
+        exit_status = radix_sort(keys, perm, numel, (int) num_threads);
+        Py_END_ALLOW_THREADS
+    }
+    free(keys);
+
+    switch (exit_status) {
+        case 0:
+            break;
+        case INT_CONVERT_FAILURE:
+            PyErr_SetString(PyExc_TypeError, "Could not cast sort key to integer");
+            break;
+        case FLOAT_CONVERT_FAILURE:
+            PyErr_SetString(PyExc_TypeError, "Could not cast sort key to double from PyFloat");
+            break;
+        case PYLONG_CONVERT_FAILURE:
+            PyErr_SetString(PyExc_TypeError, "Could not cast sort key to double from PyLong");
+            break;
+        case GET_ITEM_FAILURE:
+            PyErr_SetString(PyExc_StandardError, "Error extracting item");
+            break;
+        case ALLOC_FAILURE:
+            PyErr_NoMemory();
+            break;
+        case THREAD_FAILURE:
+            PyErr_SetString(PyExc_OSError, "OS would not create new thread");
+            break;
+        default:
+            PyErr_SetString(PyExc_TypeError, "Unsupported datatype passed");
+    }
+    if (exit_status != 0) {
+        free(perm);
+        return NULL;
+    }
+
+    // return the permutation as a list: element i is the index of the i-th row in sorted order
+    if ((outlist = PyList_New(numel)) == NULL) {
+        free(perm);
+        return NULL;
+    }
+    for (idx = 0; idx < numel; idx++)
+        PyList_SET_ITEM(outlist, idx, PyInt_FromLong(perm[idx]));
+    free(perm);
+    return outlist;
+}
+
 // initialization routines needed by Python
 static PyMethodDef _shm_methods[] = {
     {"write", _py_shm, METH_VARARGS, "Write a list to shared memory"},
+    {"sort", _py_sort, METH_VARARGS, "Compute the permutation that sorts a set of key lists"},
+    {"update", _py_update, METH_VARARGS, "Write a list into an existing shared memory segment"},
+    {"hash", _py_hash, METH_VARARGS, "Compute the content hash of a list"},
+    {"read", _py_read, METH_VARARGS, "Read a list of doubles from shared memory"},
+    {"write_file", _py_write_file, METH_VARARGS, "Write a list to a memory mapped file"},
+    {"key", _py_key, METH_VARARGS, "Obtain the key of a shared memory segment from a seed"},
+    {"stat", _py_stat, METH_VARARGS, "Look up the shared memory segment with a given key"},
     {NULL,NULL,0,NULL}
 };
 
@@ -147,6 +490,78 @@ static int len(PyObject *list)
     return length;
 }
 
+/* function to convert a Python list of row indices to a C array. Every index must be in the
+   range [0, numel). Upon error a Python exception is set and NULL is returned */
+static long *get_permutation(PyObject *perm_list, int numel)
+{
+    long *perm;
+    int idx;
+
+    if (len(perm_list) != numel) {
+        PyErr_SetString(PyExc_ValueError, "Permutation and data are of different length");
+        return NULL;
+    }
+    if ((perm = malloc((numel > 0 ? numel : 1) * sizeof(long))) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (idx = 0; idx < numel; idx++) {
+        perm[idx] = PyInt_AsLong(PyList_GET_ITEM(perm_list, idx));
+        if (perm[idx] < 0 || perm[idx] >= numel) {
+            if (PyErr_Occurred() == NULL)
+                PyErr_SetString(PyExc_IndexError, "Permutation index out of range");
+            free(perm);
+            return NULL;
+        }
+    }
+    return perm;
+}
+
+// function to set the Python exception matching an error code returned by a writer or updater
+static PyObject *set_write_error(int exit_status)
+{
+    switch (exit_status) {
+        case INT_CONVERT_FAILURE:
+            PyErr_SetString(PyExc_TypeError, "Could not cast to integer");
+            return NULL;
+        case FLOAT_CONVERT_FAILURE:
+            PyErr_SetString(PyExc_TypeError, "Could not cast to double from PyFloat");
+            return NULL;
+        case PYLONG_CONVERT_FAILURE:
+            PyErr_SetString(PyExc_TypeError, "Could not cast to double from PyLong");
+            return NULL;
+        case GET_FAILURE:
+            return PyErr_Format(PyExc_OSError, 
+                "Could not create segment. OS Returned Error %d: %s", errno, strerror(errno));
+        case ATT_FAILURE:
+            return PyErr_Format(PyExc_OSError,
+                "Could not attach segment. OS Returned Error %d: %s", errno, strerror(errno));
+        case STAT_FAILURE:
+            return PyErr_Format(PyExc_OSError,
+                "Could not query segment. OS Returned Error %d: %s", errno, strerror(errno));
+        case OFFSET_FAILURE:
+            PyErr_SetString(PyExc_ValueError, "Offset is invalid for the segment or file");
+            return NULL;
+        case OPEN_FAILURE:
+            return PyErr_Format(PyExc_OSError,
+                "Could not open file. OS Returned Error %d: %s", errno, strerror(errno));
+        case MAP_FAILURE:
+            return PyErr_Format(PyExc_OSError,
+                "Could not map file. OS Returned Error %d: %s", errno, strerror(errno));
+        case ALLOC_FAILURE:
+            return PyErr_NoMemory();
+        case LOST_FAILURE:
+            return PyErr_Format(PyExc_OSError,
+                "Could not grow segment, and the column was lost. OS Returned Error %d: %s",
+                errno, strerror(errno));
+        case GET_ITEM_FAILURE:
+            PyErr_SetString(PyExc_StandardError, "Error extracting item");
+            return NULL;
+    }
+    PyErr_SetString(PyExc_StandardError, "Undefined error occurred");
+    return NULL;
+}
+
 // function to extract an element of a Python integer list and return a C long
 static long get_long_elt(PyObject *list, int idx, int *err_flag)
 {
@@ -202,7 +617,7 @@ static double get_PyLong_elt(PyObject *list, int idx, int *err_flag)
 }
 
 // function to write a Python integer list to shared memory
-static int write_integer_list(PyObject *list, key_t key)
+static int write_integer_list(PyObject *list, key_t key, long *perm, uint64_t *hash)
 {
     int numel, segment_id, segment_size, idx, error_flag;
     long *shm, elt;
@@ -219,18 +634,21 @@ static int write_integer_list(PyObject *list, key_t key)
         return ATT_FAILURE;
     }
 
-    // write the list to the allocated segment
+    // write the list to the allocated segment, hashing it as it is copied
     numel -= 1;
+    *hash = HASH_SEED;
     error_flag = 0;
     for (idx = 0; idx <= numel; idx++) {
-        elt = get_long_elt(list, idx, &error_flag);
+        elt = get_long_elt(list, perm ? (int) perm[idx] : idx, &error_flag);
         if (error_flag == 1) {
             shmdt(shm);
             shmctl(segment_id, IPC_RMID, 0);
             return elt;
         }
         shm[idx] = elt; 
+        *hash = hash_word(*hash, (uint64_t) elt);
     }
+    *hash = hash_finish(*hash, numel + 1);
 
     // detach (but not deallocate) the segment
     shmdt(shm);
@@ -238,7 +656,7 @@ static int write_integer_list(PyObject *list, key_t key)
 }
 
 // function to write a Python float list to shared memory
-static int write_double_list(PyObject *list, key_t key)
+static int write_double_list(PyObject *list, key_t key, long *perm, uint64_t *hash)
 {
     int numel, segment_id, segment_size, idx, error_flag;
     double *shm, elt;
@@ -255,18 +673,21 @@ static int write_double_list(PyObject *list, key_t key)
         return ATT_FAILURE;
     }
 
-    // write the list to the allocated segment
+    // write the list to the allocated segment, hashing it as it is copied
     numel -= 1;
+    *hash = HASH_SEED;
     error_flag = 0;
     for (idx = 0; idx <= numel; idx++) {
-        elt = get_double_elt(list, idx, &error_flag);
+        elt = get_double_elt(list, perm ? (int) perm[idx] : idx, &error_flag);
         if (error_flag == 1) {
             shmdt(shm);
             shmctl(segment_id, IPC_RMID, 0);
             return elt;
         }
         shm[idx] = elt;
+        *hash = hash_double(*hash, elt);
     }
+    *hash = hash_finish(*hash, numel + 1);
 
     // detach (but do not deallocate) the segment
     shmdt(shm);
@@ -274,7 +695,7 @@ static int write_double_list(PyObject *list, key_t key)
 }
 
 // function to write a Python Long Integer list shared memory
-static int write_PyLong_list(PyObject *list, key_t key)
+static int write_PyLong_list(PyObject *list, key_t key, long *perm, uint64_t *hash)
 {
     int numel, segment_id, segment_size, idx, error_flag;
     double *shm, elt;
@@ -291,20 +712,429 @@ static int write_PyLong_list(PyObject *list, key_t key)
         return ATT_FAILURE;
     }
 
-    // write the list to the allocated segment
+    // write the list to the allocated segment, hashing it as it is copied
     numel -= 1;
+    *hash = HASH_SEED;
     error_flag = 0;
     for (idx = 0; idx <= numel; idx++) {
-        elt = get_PyLong_elt(list, idx, &error_flag);
+        elt = get_PyLong_elt(list, perm ? (int) perm[idx] : idx, &error_flag);
         if (error_flag == 1) {
             shmdt(shm);
             shmctl(segment_id, IPC_RMID, 0);
             return elt;
         }
         shm[idx] = elt;
+        *hash = hash_double(*hash, elt);
     }
+    *hash = hash_finish(*hash, numel + 1);
 
     // detach (but do not deallocate) the segment
     shmdt(shm);
     return segment_id; 
 }
+
+// mix an 8 byte element into a running hash
+static uint64_t hash_word(uint64_t hash, uint64_t word)
+{
+    word *= HASH_PRIME1;
+    word  = (word << 31) | (word >> 33);
+    hash ^= word * HASH_PRIME2;
+    return ((hash << 27) | (hash >> 37)) * 5 + 0x52DCE729;
+}
+
+// mix the bit pattern of a C double into a running hash
+static uint64_t hash_double(uint64_t hash, double elt)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &elt, sizeof(bits));
+    return hash_word(hash, bits);
+}
+
+// finish a hash by mixing in the number of elements and avalanching the bits
+static uint64_t hash_finish(uint64_t hash, int numel)
+{
+    hash ^= (uint64_t) numel;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* function to write a Python list into the segment with key "key", starting at element
+   "offset". Segments cannot be resized, so if the list does not fit the segment is replaced by
+   one with at least twice the capacity: the first "offset" elements are saved to the heap, the old
+   segment is marked for removal (which releases its key), a new segment is created under the same
+   key and the saved elements are copied into it. If the new segment cannot be created the saved
+   elements are restored to a segment of the old size under the same key, and if even that fails
+   the column is lost (see restore_segment) */
+static int update_segment(PyObject *list, long dtype, key_t key, long offset)
+{
+    int numel, segment_id, new_id, exit_status, saved_errno;
+    size_t elt_size, capacity, needed;
+    struct shmid_ds segment_stats;
+    char *shm, *new_shm, *saved;
+    uint64_t hash;
+
+    if ((numel = len(list)) == INT_CONVERT_FAILURE)
+        return INT_CONVERT_FAILURE;
+    elt_size = (dtype == INTEGER) ? sizeof(long) : sizeof(double);
+
+    // find and attach the existing segment
+    if ((segment_id = shmget(key, 0, S_IRUSR | S_IWUSR)) == -1)
+        return GET_FAILURE;
+    if (shmctl(segment_id, IPC_STAT, &segment_stats) == -1)
+        return STAT_FAILURE;
+    capacity = segment_stats.shm_segsz / elt_size;
+    if ((size_t) offset > capacity)
+        return OFFSET_FAILURE;
+    if ((shm = shmat(segment_id, 0, 0)) == (void *) -1)
+        return ATT_FAILURE;
+
+    // grow the segment geometrically so that repeated appends are amortized
+    needed = (size_t) offset + numel;
+    if (needed > capacity) {
+        capacity = (2 * capacity > needed) ? 2 * capacity : needed;
+        if ((saved = malloc(offset * elt_size + 1)) == NULL) {
+            shmdt(shm);
+            return ALLOC_FAILURE;
+        }
+        memcpy(saved, shm, offset * elt_size);
+        shmdt(shm);
+        shmctl(segment_id, IPC_RMID, 0);
+
+        new_id = shmget(key, capacity * elt_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+        if (new_id == -1) {
+            saved_errno = errno;
+            exit_status = restore_segment(key, segment_stats.shm_segsz, saved, offset * elt_size);
+            errno = saved_errno;
+            return (exit_status == 0) ? GET_FAILURE : exit_status;
+        }
+        if ((new_shm = shmat(new_id, 0, 0)) == (void *) -1) {
+            saved_errno = errno;
+            shmctl(new_id, IPC_RMID, 0);
+            exit_status = restore_segment(key, segment_stats.shm_segsz, saved, offset * elt_size);
+            errno = saved_errno;
+            return (exit_status == 0) ? ATT_FAILURE : exit_status;
+        }
+        memcpy(new_shm, saved, offset * elt_size);
+        free(saved);
+        shm = new_shm;
+        segment_id = new_id;
+    }
+
+    // write the list after the preserved elements and detach (but do not deallocate)
+    exit_status = copy_list(list, dtype, NULL, shm + offset * elt_size, &hash);
+    shmdt(shm);
+    return (exit_status == 0) ? segment_id : exit_status;
+}
+
+/* function to recreate a segment of "size" bytes under a given key and copy "nbytes" saved bytes
+   into it, after a segment could not be grown. The saved bytes are freed. Returns 0 if the segment
+   was restored (under a new segment ID) and LOST_FAILURE otherwise */
+static int restore_segment(key_t key, size_t size, char *saved, size_t nbytes)
+{
+    int segment_id;
+    char *shm;
+
+    segment_id = shmget(key, size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    if (segment_id == -1 || (shm = shmat(segment_id, 0, 0)) == (void *) -1) {
+        if (segment_id != -1)
+            shmctl(segment_id, IPC_RMID, 0);
+        free(saved);
+        return LOST_FAILURE;
+    }
+    memcpy(shm, saved, nbytes);
+    shmdt(shm);
+    free(saved);
+    return 0;
+}
+
+/* function to copy a Python list, taken in the order given by "perm" if it is not NULL, to memory
+   as C longs or doubles according to its data type. The content hash of the copied elements is
+   computed as they are copied, exactly as the writers compute it. If "dest" is NULL the list is
+   only hashed */
+static int copy_list(PyObject *list, long dtype, long *perm, char *dest, uint64_t *hash)
+{
+    int numel, idx, error_flag;
+    long *long_dest, elt;
+    double *double_dest, delt;
+
+    if ((numel = len(list)) == INT_CONVERT_FAILURE)
+        return INT_CONVERT_FAILURE;
+    long_dest = (long *) dest;
+    double_dest = (double *) dest;
+
+    *hash = HASH_SEED;
+    error_flag = 0;
+    for (idx = 0; idx < numel; idx++) {
+        switch (dtype) {
+            case INTEGER:
+                elt = get_long_elt(list, perm ? (int) perm[idx] : idx, &error_flag);
+                if (error_flag == 1)
+                    return (int) elt;
+                if (dest != NULL)
+                    long_dest[idx] = elt;
+                *hash = hash_word(*hash, (uint64_t) elt);
+                break;
+            case DOUBLE:
+                delt = get_double_elt(list, perm ? (int) perm[idx] : idx, &error_flag);
+                if (error_flag == 1)
+                    return (int) delt;
+                if (dest != NULL)
+                    double_dest[idx] = delt;
+                *hash = hash_double(*hash, delt);
+                break;
+            case PYLONG:
+                delt = get_PyLong_elt(list, perm ? (int) perm[idx] : idx, &error_flag);
+                if (error_flag == 1)
+                    return (int) delt;
+                if (dest != NULL)
+                    double_dest[idx] = delt;
+                *hash = hash_double(*hash, delt);
+                break;
+        }
+    }
+    *hash = hash_finish(*hash, numel);
+    return 0;
+}
+
+/* function to write a Python list to the file "path" at byte "offset", which must be a multiple
+   of the page size. The file is created if necessary and extended to hold the list, which is
+   copied through a memory mapping of the file with the same layout as a shared memory segment */
+static int write_file_list(PyObject *list, long dtype, const char *path, long offset, long *perm,
+                           uint64_t *hash)
+{
+    int numel, fd, exit_status;
+    size_t size;
+    struct stat file_stats;
+    char *data;
+
+    if ((numel = len(list)) == INT_CONVERT_FAILURE)
+        return INT_CONVERT_FAILURE;
+    if (offset < 0 || offset % sysconf(_SC_PAGESIZE) != 0)
+        return OFFSET_FAILURE;
+    size = numel * ((dtype == INTEGER) ? sizeof(long) : sizeof(double));
+
+    if ((fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+        return OPEN_FAILURE;
+    if (fstat(fd, &file_stats) == -1 || 
+        ((size_t) file_stats.st_size < offset + size && ftruncate(fd, offset + size) == -1)) {
+        close(fd);
+        return OPEN_FAILURE;
+    }
+    if (size == 0) {
+        close(fd);
+        return copy_list(list, dtype, perm, NULL, hash);
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) offset);
+    close(fd);
+    if (data == MAP_FAILED)
+        return MAP_FAILURE;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    exit_status = copy_list(list, dtype, perm, data, hash);
+    munmap(data, size);
+    return exit_status;
+}
+
+/* function to load the sort keys of a Python list, taken in the order given by "perm", into an
+   array of unsigned integers whose ordering matches the ordering of the original values */
+static int extract_sort_keys(PyObject *list, long dtype, long *perm, uint64_t *keys, long numel)
+{
+    long idx, elt;
+    double delt;
+    int error_flag;
+
+    error_flag = 0;
+    for (idx = 0; idx < numel; idx++) {
+        switch (dtype) {
+            case INTEGER:
+                elt = get_long_elt(list, (int) perm[idx], &error_flag);
+                if (error_flag == 1)
+                    return (int) elt;
+                keys[idx] = order_long(elt);
+                break;
+            case DOUBLE:
+                delt = get_double_elt(list, (int) perm[idx], &error_flag);
+                if (error_flag == 1)
+                    return (int) delt;
+                keys[idx] = order_double(delt);
+                break;
+            case PYLONG:
+                delt = get_PyLong_elt(list, (int) perm[idx], &error_flag);
+                if (error_flag == 1)
+                    return (int) delt;
+                keys[idx] = order_double(delt);
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// map a C long to an unsigned integer with the same ordering by flipping the sign bit
+static uint64_t order_long(long elt)
+{
+    return ((uint64_t) elt) ^ SIGN_BIT;
+}
+
+/* map a C double to an unsigned integer with the same ordering. Negative values have all bits
+   flipped, positive values only the sign bit. NaN is made positive so that, like Stata's
+   missing values, it sorts after every number; -0.0 is treated as equal to 0.0 */
+static uint64_t order_double(double elt)
+{
+    uint64_t bits;
+
+    if (elt != elt)
+        elt = NAN;
+    else if (elt == 0.0)
+        elt = 0.0;
+    memcpy(&bits, &elt, sizeof(bits));
+    return (bits & SIGN_BIT) ? ~bits : bits | SIGN_BIT;
+}
+
+/* function to stably sort "keys" in place, carrying "perm" along with them. Each pass the rows
+   are split into one contiguous chunk per thread: threads count the digits in their chunk, the
+   counts are turned into output positions, and threads scatter their chunk to those positions.
+   Passes in which every key shares the same digit are skipped */
+static int radix_sort(uint64_t *keys, long *perm, long numel, int num_threads)
+{
+    uint64_t *keys_buf, *keys_in, *keys_out, *keys_tmp;
+    long *perm_buf, *perm_in, *perm_out, *perm_tmp, chunk_size, offset, count;
+    int pass, digit, ix, exit_status;
+    SortChunk *chunks;
+
+    if (numel < 2)
+        return 0;
+    if (num_threads > numel / MIN_SORT_CHUNK)
+        num_threads = (int) (numel / MIN_SORT_CHUNK);
+    if (num_threads < 1)
+        num_threads = 1;
+
+    keys_buf = malloc(numel * sizeof(uint64_t));
+    perm_buf = malloc(numel * sizeof(long));
+    chunks   = malloc(num_threads * sizeof(SortChunk));
+    if (keys_buf == NULL || perm_buf == NULL || chunks == NULL) {
+        free(keys_buf);
+        free(perm_buf);
+        free(chunks);
+        return ALLOC_FAILURE;
+    }
+
+    chunk_size = (numel + num_threads - 1) / num_threads;
+    for (ix = 0; ix < num_threads; ix++) {
+        chunks[ix].lo = ix * chunk_size;
+        chunks[ix].hi = (ix + 1) * chunk_size < numel ? (ix + 1) * chunk_size : numel;
+    }
+
+    keys_in = keys; keys_out = keys_buf;
+    perm_in = perm; perm_out = perm_buf;
+    exit_status = 0;
+    for (pass = 0; pass < RADIX_PASSES; pass++) {
+        for (ix = 0; ix < num_threads; ix++) {
+            chunks[ix].keys     = keys_in;
+            chunks[ix].keys_out = keys_out;
+            chunks[ix].perm     = perm_in;
+            chunks[ix].perm_out = perm_out;
+            chunks[ix].shift    = pass * RADIX_BITS;
+        }
+        if ((exit_status = run_sort_threads(&radix_histogram, chunks, num_threads)) != 0)
+            break;
+
+        // skip the pass if a single digit accounts for every key
+        for (digit = 0; digit < RADIX_BUCKETS; digit++) {
+            count = 0;
+            for (ix = 0; ix < num_threads; ix++)
+                count += chunks[ix].counts[digit];
+            if (count != 0)
+                break;
+        }
+        if (count == numel)
+            continue;
+
+        // digits are laid out in order, and within a digit chunks are laid out in order
+        offset = 0;
+        for (digit = 0; digit < RADIX_BUCKETS; digit++) {
+            for (ix = 0; ix < num_threads; ix++) {
+                count = chunks[ix].counts[digit];
+                chunks[ix].counts[digit] = offset;
+                offset += count;
+            }
+        }
+        if ((exit_status = run_sort_threads(&radix_scatter, chunks, num_threads)) != 0)
+            break;
+
+        keys_tmp = keys_in; keys_in = keys_out; keys_out = keys_tmp;
+        perm_tmp = perm_in; perm_in = perm_out; perm_out = perm_tmp;
+    }
+
+    // an odd number of scatters leaves the sorted rows in the scratch buffers
+    if (exit_status == 0 && keys_in != keys) {
+        memcpy(keys, keys_in, numel * sizeof(uint64_t));
+        memcpy(perm, perm_in, numel * sizeof(long));
+    }
+    free(keys_buf);
+    free(perm_buf);
+    free(chunks);
+    return exit_status;
+}
+
+// function to run one phase of a radix sort pass over every chunk, one thread per chunk
+static int run_sort_threads(void *(*routine)(void *), SortChunk *chunks, int num_threads)
+{
+    pthread_t *thread_ids;
+    int ix, started, exit_status;
+
+    if (num_threads == 1) {
+        routine(&chunks[0]);
+        return 0;
+    }
+    if ((thread_ids = malloc(num_threads * sizeof(pthread_t))) == NULL)
+        return ALLOC_FAILURE;
+
+    exit_status = 0;
+    for (started = 0; started < num_threads; started++) {
+        if (pthread_create(&thread_ids[started], NULL, routine, &chunks[started]) != 0) {
+            exit_status = THREAD_FAILURE;
+            break;
+        }
+    }
+    for (ix = 0; ix < started; ix++)
+        pthread_join(thread_ids[ix], NULL);
+
+    free(thread_ids);
+    return exit_status;
+}
+
+// function to count the occurrences of each digit in a chunk of keys
+static void *radix_histogram(void *thread_args)
+{
+    SortChunk *chunk;
+    long idx;
+
+    chunk = (SortChunk *) thread_args;
+    memset(chunk->counts, 0, sizeof(chunk->counts));
+    for (idx = chunk->lo; idx < chunk->hi; idx++)
+        chunk->counts[(chunk->keys[idx] >> chunk->shift) & (RADIX_BUCKETS - 1)]++;
+    return NULL;
+}
+
+// function to move a chunk of keys (and their row indices) to their position for this pass
+static void *radix_scatter(void *thread_args)
+{
+    SortChunk *chunk;
+    long idx, dest;
+
+    chunk = (SortChunk *) thread_args;
+    for (idx = chunk->lo; idx < chunk->hi; idx++) {
+        dest = chunk->counts[(chunk->keys[idx] >> chunk->shift) & (RADIX_BUCKETS - 1)]++;
+        chunk->keys_out[dest] = chunk->keys[idx];
+        chunk->perm_out[dest] = chunk->perm[idx];
+    }
+    return NULL;
+}
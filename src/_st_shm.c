@@ -1,6 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
 
@@ -9,29 +15,65 @@
 #define GET_FAILURE    -998 // return code for failure of shmget function
 #define ATT_FAILURE    -997 // return code for failure of shmat function
 #define THREAD_FAILURE -996 // return code for failure of threading function (pthread_*())
+#define MAP_FAILURE    -995 // return code for failure to open or mmap a file
+
+#define MATRIX_TILE    64   // matrices are copied in square tiles of this many rows and columns
 
 typedef enum DTYPE_CODES {LONG, DOUBLE} DTYPE;
 typedef struct Segment {
     ST_int key;                   // the key associated with the shared memory
     ST_int dtype;                 // the data type associated with the shared memory
     ST_int varindex;              // the varindex in Stata to which data will be written
+    ST_int first;                 // the first observation to be read from the shared memory
+    ST_int file;                  // 1 if the data is in a file rather than shared memory
+    ST_double offset;             // the byte offset of the data in the file
+    char path[PATH_MAX];          // the path of the file
 } Segment;
 
+// the block of matrix rows copied between a Stata matrix and shared memory by a single thread
+typedef struct MatrixBlock {
+    char *name;                   // the name of the Stata matrix
+    double *shm;                  // the attached shared memory segment
+    ST_int rows, cols;            // the dimensions of the matrix
+    ST_int row_lo, row_hi;        // the rows [row_lo, row_hi) copied by this thread
+    int colmajor;                 // 1 if the segment is stored column-major, 0 if row-major
+    int put;                      // 1 to copy from Stata to shared memory, 0 for the reverse
+    ST_retcode rc;                // the return status of the thread
+} MatrixBlock;
+
 // reading functions. These take a list in shared memory and write them to the Stata data array
-static ST_retcode read_long_list(key_t key, ST_int varindex);
-static ST_retcode read_double_list(key_t key, ST_int varindex);
+static ST_retcode read_long_list(long *shm, ST_int varindex, ST_int first);
+static ST_retcode read_double_list(double *shm, ST_int varindex, ST_int first);
 static void *thread_mgr(void *thread_args);
 
-// main function. Calls readers and returns exit statuses
+/* access functions. These make the list to be read available in memory, either by attaching a
+   shared memory segment or by mapping a file with the same layout. They return NULL on error */
+static void *attach_segment(key_t key, size_t segment_size);
+static void *map_file(char *path, off_t offset, size_t size);
+
+/* matrix functions. These copy a Stata matrix to or from a single shared memory segment holding
+   its elements as C doubles, in row-major or column-major order */
+static ST_retcode matrix_call(int argc, char *argv[]);
+static ST_retcode copy_matrix(char *name, double *shm, ST_int rows, ST_int cols, int colmajor,
+                              int put);
+static void *matrix_block_mgr(void *thread_args);
+
+/* main function. Calls readers and returns exit statuses. Called with the arguments "matrix ..."
+   it transfers a matrix instead (see matrix_call) */
 STDLL stata_call(int argc, char *argv[]) 
 {
     int num_threads, thread_rc, ix;
     pthread_t *thread_ids;
     ST_retcode rc;
-    ST_double key, dtype;
+    ST_double key, dtype, first, file, offset;
+    char macro_name[32];
     int *thread_exit_codes;
+    void *thread_exit_code;
     Segment *segments;
 
+    if (argc > 0 && strcmp(argv[0], "matrix") == 0)
+        return matrix_call(argc, argv);
+
     // create an array of Segment structs to pass arguments to threads
     num_threads = SF_nvars();
     segments = malloc(num_threads * sizeof(Segment));
@@ -64,10 +106,40 @@ STDLL stata_call(int argc, char *argv[])
             return rc;
         }
 
+        if ((rc = SF_mat_el("_shm_first", ix+1, 1, &first))) {
+            SF_display("Error accessing shared memory first observations\n");
+            free(segments);
+            free(thread_ids);
+            return rc;
+        }
+
+        if ((rc = SF_mat_el("_shm_files", ix+1, 1, &file)) ||
+            (rc = SF_mat_el("_shm_offsets", ix+1, 1, &offset))) {
+            SF_display("Error accessing file offsets\n");
+            free(segments);
+            free(thread_ids);
+            return rc;
+        }
+
+        // the path of a file is passed in the local macro shm_path<ix>
+        segments[ix].path[0] = '\0';
+        if (file != 0) {
+            snprintf(macro_name, sizeof(macro_name), "_shm_path%d", ix+1);
+            if ((rc = SF_macro_use(macro_name, segments[ix].path, PATH_MAX))) {
+                SF_display("Error accessing file path\n");
+                free(segments);
+                free(thread_ids);
+                return rc;
+            }
+        }
+
         // load the parameters into structs that will be passed to threads
         segments[ix].key = (ST_int) key;
         segments[ix].dtype = (ST_int) dtype;
         segments[ix].varindex = (ST_int) ix+1;
+        segments[ix].first = (ST_int) first;
+        segments[ix].file = (file != 0);
+        segments[ix].offset = offset;
     }
 
     /* start the threads - if any thread fails to start the program will exit and threads will be
@@ -85,7 +157,8 @@ STDLL stata_call(int argc, char *argv[])
     // join the threads stared above to capture their return status.
     thread_exit_codes = malloc(num_threads * sizeof(int));
     for (ix = 0; ix < num_threads; ix++) {
-        thread_rc = pthread_join(thread_ids[ix], (void **) &thread_exit_codes[ix]);
+        thread_rc = pthread_join(thread_ids[ix], &thread_exit_code);
+        thread_exit_codes[ix] = (int) (long) thread_exit_code;
         if (thread_rc != 0) {
             SF_display("Could not join thread\n");
             free(segments);
@@ -99,10 +172,11 @@ STDLL stata_call(int argc, char *argv[])
     for (ix = 0; ix < num_threads; ix++) {
         if (thread_exit_codes[ix] != 0) {
             SF_display("Thread returned error\n");
+            rc = (ST_retcode) thread_exit_codes[ix];
             free(segments);
             free(thread_exit_codes);
             free(thread_ids);
-            return (ST_retcode) rc;
+            return rc;
         }
     }
 
@@ -112,90 +186,295 @@ STDLL stata_call(int argc, char *argv[])
     return 0;
 }
 
-/* function to handle arguments passed to threads. This takes a Struct Segment as an argument
-   and calls the appropriate reading functions based on the passed data type */
+/* function to handle arguments passed to threads. This takes a Struct Segment as an argument,
+   attaches the segment (or maps the file) holding the data and calls the appropriate reading
+   functions based on the passed data type */
 static void *thread_mgr(void *thread_args) 
 {
     Segment *segment_info;
-    key_t key;
     DTYPE dtype;
-    ST_int varindex;
+    ST_int varindex, first;
     ST_retcode rc;
+    size_t size;
+    void *data;
 
     segment_info = (Segment *) thread_args; // cast the void struct to the appropriate type
-    key   = (key_t) segment_info->key;
     dtype = (DTYPE) segment_info->dtype;
     varindex = segment_info->varindex;
+    first = segment_info->first;
+
+    // Note that length of Stata vector is equal to length of shared memory segment
+    size = (size_t) SF_nobs() * ((dtype == LONG) ? sizeof(long) : sizeof(double));
+    if (segment_info->file)
+        data = map_file(segment_info->path, (off_t) segment_info->offset, size);
+    else
+        data = attach_segment((key_t) segment_info->key, size);
+    if (data == NULL)
+        return (void *) (long) (segment_info->file ? MAP_FAILURE : GET_FAILURE);
  
     // call the reader appropriate for the data type passed
     switch (dtype) {
         case LONG:
-            rc = read_long_list(key, varindex);
+            rc = read_long_list((long *) data, varindex, first);
             break;
         case DOUBLE:
-            rc = read_double_list(key, varindex);
+            rc = read_double_list((double *) data, varindex, first);
             break;
     }
-    return (void *) rc;
+
+    if (segment_info->file)
+        munmap(data, size);
+    else
+        shmdt(data);
+    return (void *) (long) rc;
 }
 
-// function to read a list of long integers from shared memory into Stata
-static ST_retcode read_long_list(key_t key, ST_int varindex) 
+// function to attach an existing shared memory segment of at least "segment_size" bytes
+static void *attach_segment(key_t key, size_t segment_size)
 {
-    ST_retcode rc;
-    int segment_id, numel, idx;
-    size_t segment_size;
-    long *shm, elt;
+    int segment_id;
+    void *shm;
 
-    // allocate the shared memory segment. Note that length of Stata vector is equal to length
-    // of shared memory segment
-    numel = SF_nobs();
-    segment_size = numel * sizeof(long);
     segment_id = shmget(key, segment_size, S_IRUSR | S_IWUSR);
     if (segment_id == -1) {
         SF_display("Could not get segment\n");
-        return (ST_retcode) GET_FAILURE; 
+        return NULL; 
     }
-    if ((shm = shmat(segment_id, 0, 0)) == NULL) {
+    if ((shm = shmat(segment_id, 0, 0)) == (void *) -1) {
         SF_display("Could not attach segment\n");
-        return (ST_retcode) ATT_FAILURE;
+        return NULL;
+    }
+    return shm;
+}
+
+/* function to map "size" bytes of a file, starting at "offset", read-only. The kernel is told
+   the mapping will be read sequentially, so that it reads ahead aggressively and drops pages
+   behind the reader, and that all of it will be needed, so that reading starts immediately */
+static void *map_file(char *path, off_t offset, size_t size)
+{
+    int fd;
+    struct stat file_stats;
+    void *data;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        SF_display("Could not open file\n");
+        return NULL;
     }
+    if (fstat(fd, &file_stats) == -1 || file_stats.st_size < offset + (off_t) size) {
+        SF_display("File is shorter than the data it should hold\n");
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, size > 0 ? size : 1, PROT_READ, MAP_SHARED, fd, offset);
+    close(fd);
+    if (data == MAP_FAILED) {
+        SF_display("Could not map file\n");
+        return NULL;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    madvise(data, size, MADV_WILLNEED);
+    return data;
+}
+
+/* function to read a list of long integers from shared memory into Stata. Observations before
+   "first" are already in memory and are skipped */
+static ST_retcode read_long_list(long *shm, ST_int varindex, ST_int first) 
+{
+    ST_retcode rc;
+    int idx;
+    ST_double elt;
 
-    for (idx = SF_in1(); idx <= SF_in2(); idx++) {
+    for (idx = (first > SF_in1() ? first : SF_in1()); idx <= SF_in2(); idx++) {
         elt = (ST_double) shm[idx-1];
         if ((rc = SF_vstore(varindex, idx, elt)) != 0) {
             return rc;
         }
     }
-    shmdt(shm);
     return (ST_retcode) 0;
 }
 
-// function to read a list of floating point values from shared memory into Stata
-static ST_retcode read_double_list(key_t key, ST_int varindex) {
+/* function to read a list of floating point values from shared memory into Stata. NaN is stored
+   as Stata's missing value, which also sorts after all numbers */
+static ST_retcode read_double_list(double *shm, ST_int varindex, ST_int first) {
+    ST_retcode rc;
+    int idx;
+    ST_double elt;
+
+    for (idx = (first > SF_in1() ? first : SF_in1()); idx <= SF_in2(); idx++) {
+        elt = (ST_double) shm[idx-1];
+        if (elt != elt)
+            elt = SV_missval;
+        if ((rc = SF_vstore(varindex, idx, elt)) != 0) {
+            return rc;
+        }
+    }
+    return (ST_retcode) 0;
+}
+
+/* function to transfer a matrix. Arguments (argv[0] is "matrix"):
+       matrix get <name> <key> <order>:  read the segment with key <key> into the existing Stata
+                                         matrix <name>, which gives the dimensions
+       matrix put <name> <seed> <order>: write the Stata matrix <name> to a new segment whose key
+                                         is obtained from ftok with <seed>. The key and segment ID
+                                         are returned in the scalars _shm_key and _shm_segment_id
+   <order> is "C" for row-major or "F" for column-major segments */
+static ST_retcode matrix_call(int argc, char *argv[])
+{
     ST_retcode rc;
-    int segment_id, numel, idx;
+    ST_int rows, cols;
+    int segment_id, put, colmajor;
     size_t segment_size;
-    double *shm, elt;
+    key_t key;
+    double *shm;
 
-    numel = SF_nobs();
-    segment_size = numel * sizeof(double);
-    segment_id = shmget(key, segment_size, S_IRUSR | S_IWUSR);
+    if (argc != 5 || (strcmp(argv[1], "get") != 0 && strcmp(argv[1], "put") != 0)) {
+        SF_error("Usage: matrix get|put name key|seed C|F\n");
+        return 198;
+    }
+    put = (strcmp(argv[1], "put") == 0);
+    colmajor = (strcmp(argv[4], "F") == 0);
+    rows = SF_row(argv[2]);
+    cols = SF_col(argv[2]);
+    if (rows < 1 || cols < 1) {
+        SF_error("Matrix not found\n");
+        return 111;
+    }
+    segment_size = (size_t) rows * cols * sizeof(double);
+
+    // attach the existing segment, or allocate a new one for "put"
+    if (put) {
+        if ((key = ftok("/tmp", atoi(argv[3]))) == (key_t) -1) {
+            SF_error("Could not create new key\n");
+            return (ST_retcode) GET_FAILURE;
+        }
+        segment_id = shmget(key, segment_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    }
+    else {
+        key = (key_t) atol(argv[3]);
+        segment_id = shmget(key, segment_size, S_IRUSR | S_IWUSR);
+    }
     if (segment_id == -1) {
-        SF_display("Could not get segment\n");
-        return (ST_retcode) GET_FAILURE; 
+        SF_error("Could not get segment\n");
+        return (ST_retcode) GET_FAILURE;
     }
-    if ((shm = shmat(segment_id,0,0)) == NULL) {
-        SF_display("Could not attach segment\n");
+    if ((shm = shmat(segment_id, 0, 0)) == (void *) -1) {
+        SF_error("Could not attach segment\n");
+        if (put) shmctl(segment_id, IPC_RMID, 0);
         return (ST_retcode) ATT_FAILURE;
     }
 
-    for (idx = SF_in1(); idx <= SF_in2(); idx++) {
-        elt = (ST_double) shm[idx-1];
-        if ((rc = SF_vstore(varindex, idx, elt)) != 0) {
+    rc = copy_matrix(argv[2], shm, rows, cols, colmajor, put);
+    shmdt(shm);
+
+    if (put) {
+        if (rc != 0) {
+            shmctl(segment_id, IPC_RMID, 0);
             return rc;
         }
+        if ((rc = SF_scal_save("_shm_key", (ST_double) key)))
+            return rc;
+        if ((rc = SF_scal_save("_shm_segment_id", (ST_double) segment_id)))
+            return rc;
     }
-    shmdt(shm);
-    return (ST_retcode) 0;
+    return rc;
+}
+
+/* function to copy a matrix between Stata and shared memory. Rows are split into blocks of
+   whole tiles, one block per thread. Missing values are stored as NaN in shared memory */
+static ST_retcode copy_matrix(char *name, double *shm, ST_int rows, ST_int cols, int colmajor,
+                              int put)
+{
+    MatrixBlock *blocks;
+    pthread_t *thread_ids;
+    ST_int ntiles, tiles_per_thread;
+    int num_threads, started, ix;
+    ST_retcode rc;
+
+    ntiles = (rows + MATRIX_TILE - 1) / MATRIX_TILE;
+    num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > ntiles)
+        num_threads = ntiles;
+    if (num_threads < 1)
+        num_threads = 1;
+    tiles_per_thread = (ntiles + num_threads - 1) / num_threads;
+
+    blocks = malloc(num_threads * sizeof(MatrixBlock));
+    thread_ids = malloc(num_threads * sizeof(pthread_t));
+    if (blocks == NULL || thread_ids == NULL) {
+        SF_error("Operating system would not allocate memory\n");
+        free(blocks);
+        free(thread_ids);
+        return 909;
+    }
+
+    for (ix = 0; ix < num_threads; ix++) {
+        blocks[ix].name = name;
+        blocks[ix].shm = shm;
+        blocks[ix].rows = rows;
+        blocks[ix].cols = cols;
+        blocks[ix].colmajor = colmajor;
+        blocks[ix].put = put;
+        blocks[ix].row_lo = ix * tiles_per_thread * MATRIX_TILE;
+        blocks[ix].row_hi = (ix + 1) * tiles_per_thread * MATRIX_TILE;
+        if (blocks[ix].row_lo > rows) blocks[ix].row_lo = rows;
+        if (blocks[ix].row_hi > rows) blocks[ix].row_hi = rows;
+        blocks[ix].rc = 0;
+    }
+
+    // start the threads and wait for all that started before checking their return status
+    rc = 0;
+    for (started = 0; started < num_threads; started++) {
+        if (pthread_create(&thread_ids[started], NULL, &matrix_block_mgr, &blocks[started]) != 0) {
+            SF_error("OS would not create new thread\n");
+            rc = (ST_retcode) THREAD_FAILURE;
+            break;
+        }
+    }
+    for (ix = 0; ix < started; ix++) {
+        pthread_join(thread_ids[ix], NULL);
+        if (rc == 0 && blocks[ix].rc != 0) {
+            SF_error("Thread returned error\n");
+            rc = blocks[ix].rc;
+        }
+    }
+
+    free(blocks);
+    free(thread_ids);
+    return rc;
+}
+
+// function to copy the rows of a matrix assigned to a thread, one tile at a time
+static void *matrix_block_mgr(void *thread_args)
+{
+    MatrixBlock *block;
+    ST_int row0, col0, row, col, row_end, col_end;
+    ST_double elt;
+    size_t idx;
+
+    block = (MatrixBlock *) thread_args;
+    for (row0 = block->row_lo; row0 < block->row_hi; row0 += MATRIX_TILE) {
+        row_end = (row0 + MATRIX_TILE < block->row_hi) ? row0 + MATRIX_TILE : block->row_hi;
+        for (col0 = 0; col0 < block->cols; col0 += MATRIX_TILE) {
+            col_end = (col0 + MATRIX_TILE < block->cols) ? col0 + MATRIX_TILE : block->cols;
+            for (row = row0; row < row_end; row++) {
+                for (col = col0; col < col_end; col++) {
+                    idx = block->colmajor ? (size_t) col * block->rows + row
+                                          : (size_t) row * block->cols + col;
+                    if (block->put) {
+                        if ((block->rc = SF_mat_el(block->name, row+1, col+1, &elt)))
+                            return NULL;
+                        block->shm[idx] = SF_is_missing(elt) ? NAN : elt;
+                    }
+                    else {
+                        elt = block->shm[idx];
+                        if (elt != elt)
+                            elt = SV_missval;
+                        if ((block->rc = SF_mat_store(block->name, row+1, col+1, elt)))
+                            return NULL;
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
 }
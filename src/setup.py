@@ -2,7 +2,8 @@ import distutils.core as dst
 
 shm_module = dst.Extension(
     '_py_shm', 
-    sources = ['_py_shm.c']
+    sources = ['_py_shm.c'],
+    libraries = ['pthread']
 )
 
 dst.setup(
@@ -1,5 +1,6 @@
 import pandas as pd
-import re, os, sys
+import numpy as np
+import re, os, sys, mmap
 sys.path.append('../build')
 import _py_shm
 
@@ -14,9 +15,15 @@ import _py_shm
                       _py_shm for writing
     2) write_frame(): A utility for passing a Pandas data frame to write_list(). It iterates
                       over columns in the data frame and handles inferring types and incrementing
-                      key generator seeds 
+                      key generator seeds. It can optionally sort the frame by key columns
     3) deallocate():  A utility which wraps the command line "ipcrm -m" command to remove a shared
                       memory segment 
+    4) append_rows(): Appends the rows of a data frame to segments written by write_frame(),
+                      growing the segments in place
+    5) replace_columns(): Overwrites (or adds) columns of segments written by write_frame()
+    6) write_matrix(): Writes a 2-D array to a single segment, to be read into a Stata matrix by
+                       "shm_matrix get"
+    7) read_matrix():  Reads a matrix written by "shm_matrix put" into a 2-D Numpy array
 
     Examples:
     >>> integer_list = range(100000) 
@@ -40,21 +47,82 @@ import _py_shm
        guaranteed. 
     5) Information about allocated segments needed by other programs (e.g. Stata) is written to a 
        tab delimited file which contains:
-            segment_key -> segment_id -> data_type -> length -> variable_name 
+            segment_key -> segment_id -> data_type -> length -> variable_name -> sort_position ->
+            version -> modified -> hash -> path -> offset
+       path is 0 for segments in shared memory (see note 10 below)
+       sort_position is 0 for a variable the data is not sorted by, and otherwise the variable's
+       position (starting at 1) in the list of sort keys
+    6) Sorting is done in _py_shm with a multithreaded radix sort which returns a permutation of
+       the rows. Columns are written in the permuted order so the frame itself is never copied.
+       Missing values (NaN) sort after all numbers, as in Stata, and shm_use loads them as missing
+    7) append_rows() and replace_columns() update the segments listed in an info file in place and
+       rewrite the file. Every update increments a version counter which is recorded for all
+       segments in the "version" field, and the "modified" field of a segment holds the version in
+       which its contents were last replaced. "shm_use, update" uses these to load only appended
+       rows and replaced columns into data already in Stata. Segments are reallocated (under the
+       same key, but with a new segment ID) with twice their capacity when an append doesn't fit,
+       so the info file should always be used for the current segment IDs. If a larger segment
+       cannot be created the old contents are restored under the same key (again with a new ID)
+       and an OSError is raised; should that also fail the column is lost and is removed from the
+       info file. Updates clear the recorded sort order when they could break it
+    8) Every segment written is recorded in a cache keyed by a hash of its contents (computed in
+       _py_shm as the column is copied), its data type and its length. With use_cache=True
+       write_frame() hashes each column and, if an identical column is still in shared memory,
+       lists that segment in the info file instead of writing a new one. Segments may therefore be
+       shared by several frames: deallocating (or updating) a frame's segments affects every frame
+       that shares them. Cached segments which have since been deallocated are detected and
+       written again. Rewriting a frame with use_cache=True replaces its info file and deallocates
+       the segments of the old info file which are not reused, so re-running an export does not
+       leak the segments of changed columns. A segment is never listed twice in one info file, and
+       the module keeps track of the info files written or updated in the current process: a
+       segment still listed by another of them is not deallocated, and append_rows() and
+       replace_columns() refuse to update it (write the frame again without use_cache instead)
+    9) Matrices are stored as C doubles in a single segment, in row-major ('C') or column-major
+       ('F') order, and described in their own tab delimited file which contains:
+            segment_key -> segment_id -> rows -> columns -> order -> matrix_name
+       Missing values in Stata matrices correspond to NaN
+   10) write_frame() can store a frame in a file instead of shared memory (path=...). Each column is
+       laid out exactly as in a segment, starting at a page aligned offset in the file, and is
+       written through a memory mapping. The info file records the file path and offset of each
+       column (key and segment ID are 0), and shm_use maps the file to load it. Files persist across
+       reboots and may exceed RAM, so a frame written once can be loaded in any later session for
+       as long as the file (and its info file) is kept. The file and info file are written to
+       temporary files and renamed into place, so writing a frame again replaces both without
+       disturbing a session which has the old file mapped. Frames stored in files cannot be updated
+       with append_rows() or replace_columns()
 """
 
 DTYPE_CODES = {'int' : 0, 'float' : 1, 'long' : 2}
+INFO_FIELDS = ['key', 'segment_id', 'dtype', 'numel', 'varname', 'sort_position', 'version',
+               'modified', 'hash', 'path', 'offset']
 
-def write_list(data, dtype, varname, key_seed, info_file='segment_info.txt'):
+MATRIX_FIELDS = ['key', 'segment_id', 'rows', 'cols', 'order', 'name']
+
+# cache of written segments: (hash, dtype code, length) -> (segment_key, segment_id)
+_column_cache = dict()
+
+# info files written or updated in this process: absolute path -> set of (segment_key, segment_id)
+# of the segments in shared memory it lists (see note 8 above)
+_manifests = dict()
+
+def write_list(data, dtype, varname, key_seed, info_file='segment_info.txt', permutation=None,
+               sort_position=0):
     """ 
         Write a list to a shared memory segment
         
         Arguments:
-            data      -- the list to be written. Must be of a constant real numeric data type
-            dtype     -- the data's type. String types are mapped to numeric codes in "DTYPE_CODES"
-            varname   -- the 'name' of the list. Any arbitrary string.
-            key_seed  -- an integer used in the "ftok()" function to obtain a key for shared memory
-            info_file -- a path to a file that will contain information about the segment allocated
+            data          -- the list to be written. Must be of a constant real numeric data type
+            dtype         -- the data's type. String types are mapped to numeric codes in 
+                             "DTYPE_CODES"
+            varname       -- the 'name' of the list. Any arbitrary string.
+            key_seed      -- an integer used in the "ftok()" function to obtain a key for shared
+                             memory
+            info_file     -- a path to a file that will contain information about the segment
+                             allocated
+            permutation   -- (optional) a list of indices. Element i of the segment is data[i]
+                             when omitted and data[permutation[i]] otherwise
+            sort_position -- the position of the list among the keys the data is sorted by, or 0
+                             if the data is not sorted by it (see note 5 above)
     """
     try: 
         dtype_key = DTYPE_CODES[dtype]
@@ -62,21 +130,28 @@ def write_list(data, dtype, varname, key_seed, info_file='segment_info.txt'):
        raise TypeError("Unsupported data type passed")
 
     # Call the C extension that actually does the writing
-    shm_key, segment_id = _py_shm.write(data, dtype_key, key_seed)
+    if permutation is None:
+        shm_key, segment_id, content_hash = _py_shm.write(data, dtype_key, key_seed)
+    else:
+        shm_key, segment_id, content_hash = _py_shm.write(data, dtype_key, key_seed, permutation)
     
     numel = len(data)
+    segment = {
+        'key'     : shm_key,   'segment_id'    : segment_id,    'dtype'   : dtype_key,
+        'numel'   : numel,     'sort_position' : sort_position, 'version' : 0, 
+        'varname' : varname,   'modified'      : 0,             'hash'    : format_hash(content_hash),
+        'path'    : '0',       'offset'        : 0
+    }
+    cache_segment(segment)
 
     # write a text file containing information about the allocated segment
     with open(info_file, mode = 'ab') as fh:
-        fh.write(
-            str(shm_key)   + '\t' + str(segment_id) + '\t' + 
-            str(dtype_key) + '\t' + str(numel)      + '\t' + 
-            varname + '\n'
-        )
+        fh.write(format_info(segment))
     
     return (shm_key, segment_id)
     
-def write_frame(frame, info_file='segment_info.txt', key_seed=1):
+def write_frame(frame, info_file='segment_info.txt', key_seed=1, sort_by=None, use_cache=False,
+                path=None):
     """
         Write a Pandas data frame to shared memory. 
         Calls "write_list()" over each column of the data frame. See note 4 above about data
@@ -88,41 +163,454 @@ def write_frame(frame, info_file='segment_info.txt', key_seed=1):
                          the frame will be written
             key_seed  -- the "initial" seed that will be passed to "ftok()" subsequent seeds are
                          incremented by one.
+            sort_by   -- (optional) a list of column names. Rows are written sorted by these
+                         columns (see note 6 above) and the sort order is recorded in info_file
+            use_cache -- reuse segments already holding identical columns (see note 8 above).
+                         The segments listed in an existing info_file are added to the cache and
+                         the file is replaced rather than appended to, once the frame has been
+                         written. Its segments which the frame does not reuse are then
+                         deallocated. Seeds whose keys are in use are skipped
+            path      -- (optional) a file to store the frame in instead of shared memory (see
+                         note 10 above). Any existing file, and info_file, are replaced once the
+                         frame has been written, and segments in shared memory listed in the old
+                         info_file are deallocated. The frame's columns are then mapped to (path,
+                         offset) pairs in the returned dictionary
     """
     varnames = frame.columns.tolist()
+
+    if path is not None:
+        if use_cache:
+            raise ValueError('Frames stored in files cannot use the segment cache')
+        path = os.path.abspath(path)
+        offset = 0
+
+    # compute the permutation that sorts the frame before anything is allocated
+    permutation = None
+    sort_by = list(sort_by) if sort_by is not None else []
+    if len(sort_by) > 0:
+        for varname in sort_by:
+            if varname not in varnames:
+                raise KeyError('Sort key: ' + str(varname) + ' is not a column of the frame')
+        keys = [frame.loc[:,varname].values.tolist() for varname in sort_by]
+        dtypes = []
+        for varname, data in zip(sort_by, keys):
+            dtype = infer_dtype(data)
+            if dtype is None:
+                raise TypeError('Sort key: ' + varname + ' is of an unsupported type')
+            dtypes.append(DTYPE_CODES[dtype])
+        permutation = _py_shm.sort(keys, dtypes)
+
+    # with the cache, or in a file, the frame is listed in a new info file which replaces the old
+    # one only once every column has been written
+    previous_segments = []
+    manifest = info_file
+    if (use_cache or path is not None) and os.path.exists(info_file):
+        previous_segments = read_info(info_file)
+        if use_cache:
+            for segment in previous_segments: cache_segment(segment)
+    if use_cache or path is not None:
+        manifest = info_file + '.tmp'
+        if os.path.exists(manifest):
+            os.unlink(manifest)
+    if path is not None:
+        open(path + '.tmp', mode = 'wb').close()
     
     allocated_segments = dict()
+    reused_segments = set()
     for varname in varnames:
         data = frame.loc[:,varname].values.tolist()
 
         # infer data type from first element in the list (see note 3 above about data types)
-        if isinstance(data[0], int):
-            dtype = 'int'
-        elif isinstance(data[0], float): 
-            dtype = 'float'
-        elif isinstance(data[0], long): 
-            dtype = 'long'
-        else: 
+        dtype = infer_dtype(data)
+        if dtype is None:
             # if an unsupported type is passed raise exception and clean up existing segments
-            if len(allocated_segments) > 0:
-                for segment in allocated_segments:
-                    deallocate(allocated_segments[segment][1])
+            discard_frame(allocated_segments, reused_segments, path, manifest, info_file)
             raise TypeError('Column: ' + varname + ' is of an unsupported type')
         
+        sort_position = sort_by.index(varname) + 1 if varname in sort_by else 0
+
         # call the underlying writer - if an error occurs clean up any existing segments
         try:
-            segment_info = write_list(data, dtype, varname, key_seed, info_file)
+            segment_info = None
+            if use_cache:
+                segment_info = reuse_list(data, dtype, varname, manifest, permutation,
+                                          sort_position, set(allocated_segments.values()))
+                if segment_info is not None:
+                    reused_segments.add(varname)
+                else:
+                    key_seed = free_key_seed(key_seed)
+            if segment_info is None and path is not None:
+                segment_info = write_file(data, dtype, varname, path, offset, manifest,
+                                          permutation, sort_position)
+                offset = page_align(offset + 8 * len(data))
+            elif segment_info is None:
+                segment_info = write_list(data, dtype, varname, key_seed, manifest, 
+                                          permutation, sort_position)
         except Exception:
-            if len(allocated_segments) > 0:
-                for segment in allocated_segments:
-                    deallocate(allocated_segments[segment][1])
+            discard_frame(allocated_segments, reused_segments, path, manifest, info_file)
             raise
 
         allocated_segments[varname] = segment_info
-        key_seed += 1  # increment the seed used to obtain segment IDs in C
+        if varname not in reused_segments:
+            key_seed += 1  # increment the seed used to obtain segment IDs in C
+
+    # move a file written alongside the old one into its place. Sessions which have the old file
+    # mapped keep reading it
+    if path is not None:
+        os.rename(path + '.tmp', path)
+
+    # replace the old info file and free the segments it listed which are no longer used
+    if manifest != info_file:
+        os.rename(manifest, info_file)
+        in_use = set(allocated_segments.values())
+        for segment in previous_segments:
+            shm_id = (segment['key'], segment['segment_id'])
+            if (segment['path'] == '0' and shm_id not in in_use and 
+                not listed_elsewhere(shm_id, info_file)):
+                release_segment(segment)
+    register_manifest(read_info(info_file), info_file)
         
     return allocated_segments
 
+# utility function to clean up after write_frame() fails: deallocates the segments (or removes the
+# file) written so far, and removes the new info file if one was started
+def discard_frame(allocated_segments, reused_segments, path, manifest, info_file):
+    if path is not None:
+        os.unlink(path + '.tmp')
+    else:
+        for segment in allocated_segments:
+            if segment not in reused_segments:
+                deallocate(allocated_segments[segment][1])
+    if manifest != info_file and os.path.exists(manifest):
+        os.unlink(manifest)
+
+# utility function to deallocate a segment listed in an info file, if it is still allocated
+def release_segment(segment):
+    segment_stat = _py_shm.stat(segment['key'])
+    if segment_stat is not None and segment_stat[0] == segment['segment_id']:
+        forget_segment(segment)
+        deallocate(segment['segment_id'])
+
+# utility function to list a cached segment holding the same contents as a list in an info file
+# (see note 8 above). Segments in "in_use", which already hold other columns of the frame, are not
+# reused. Returns the segment key and ID, or None if no such segment exists
+def reuse_list(data, dtype, varname, info_file, permutation=None, sort_position=0, in_use=()):
+    dtype_key = DTYPE_CODES[dtype]
+    if permutation is None:
+        content_hash = format_hash(_py_shm.hash(data, dtype_key))
+    else:
+        content_hash = format_hash(_py_shm.hash(data, dtype_key, permutation))
+
+    cache_key = (content_hash, dtype_key, len(data))
+    if cache_key not in _column_cache:
+        return None
+
+    # check that the segment has not been deallocated, or replaced by another under its key
+    shm_key, segment_id = _column_cache[cache_key]
+    if (shm_key, segment_id) in in_use:
+        return None
+    segment_stat = _py_shm.stat(shm_key)
+    if segment_stat is None or segment_stat[0] != segment_id or segment_stat[1] < 8 * len(data):
+        del _column_cache[cache_key]
+        return None
+
+    with open(info_file, mode = 'ab') as fh:
+        fh.write(format_info({
+            'key'     : shm_key,   'segment_id'    : segment_id,    'dtype'   : dtype_key,
+            'numel'   : len(data), 'sort_position' : sort_position, 'version' : 0, 
+            'varname' : varname,   'modified'      : 0,             'hash'    : content_hash,
+            'path'    : '0',       'offset'        : 0
+        }))
+    return (shm_key, segment_id)
+
+# utility function to write a list to a file at a page aligned offset and record it in an info
+# file (see note 10 above). The list is written to the temporary file path.tmp, which write_frame()
+# renames to path once the frame is complete. Returns the path and offset
+def write_file(data, dtype, varname, path, offset, info_file, permutation=None, sort_position=0):
+    dtype_key = DTYPE_CODES[dtype]
+    if permutation is None:
+        content_hash = _py_shm.write_file(data, dtype_key, path + '.tmp', offset)
+    else:
+        content_hash = _py_shm.write_file(data, dtype_key, path + '.tmp', offset, permutation)
+
+    with open(info_file, mode = 'ab') as fh:
+        fh.write(format_info({
+            'key'     : 0,         'segment_id'    : 0,             'dtype'   : dtype_key,
+            'numel'   : len(data), 'sort_position' : sort_position, 'version' : 0, 
+            'varname' : varname,   'modified'      : 0,             'hash'    : format_hash(content_hash),
+            'path'    : path,      'offset'        : offset
+        }))
+    return (path, offset)
+
+# utility function to round a file offset up to the next page boundary
+def page_align(offset):
+    return -(-offset // mmap.PAGESIZE) * mmap.PAGESIZE
+
+# utility function to find the first seed from key_seed on whose key is not in use
+def free_key_seed(key_seed):
+    for attempt in range(256):
+        if _py_shm.stat(_py_shm.key(key_seed)) is None:
+            return key_seed
+        key_seed += 1
+    raise OSError('Every key seed is in use')
+
+# utility function to infer the data type of a list from its first element. Returns None if the
+# type is unsupported
+def infer_dtype(data):
+    if len(data) == 0:
+        return None
+    if isinstance(data[0], int):
+        return 'int'
+    elif isinstance(data[0], float): 
+        return 'float'
+    elif isinstance(data[0], long): 
+        return 'long'
+    return None
+
+def append_rows(frame, info_file='segment_info.txt'):
+    """
+        Append the rows of a Pandas data frame to the segments listed in an info file. The frame
+        must have the same columns, of the same types, as the frame originally written
+
+        Arguments:
+            frame     -- the Pandas data frame whose rows will be appended
+            info_file -- a path to the file describing the segments, as written by write_frame().
+                         The file is rewritten with the new lengths and version (see note 7 above)
+    """
+    segments = read_info(info_file)
+    check_in_memory(segments, info_file)
+    check_unshared(segments, segments, info_file)
+    varnames = [segment['varname'] for segment in segments]
+    if sorted(frame.columns.tolist()) != sorted(varnames):
+        raise KeyError('Appended rows must have the same columns as the segments in ' + info_file)
+    if len(frame) == 0:
+        return dict((segment['varname'], (segment['key'], segment['segment_id'])) 
+                    for segment in segments)
+
+    # check every column before any segment is modified
+    columns = dict()
+    for segment in segments:
+        data = frame.loc[:,segment['varname']].values.tolist()
+        dtype = infer_dtype(data)
+        if dtype is None or DTYPE_CODES[dtype] != segment['dtype']:
+            raise TypeError('Column: ' + segment['varname'] + ' does not match the type of its segment')
+        columns[segment['varname']] = data
+
+    # write each column after the existing rows. Lengths are only updated once every column has
+    # been written but segment IDs (which change when a segment grows) are always recorded
+    try:
+        for segment in segments:
+            update_list(segment, columns[segment['varname']], segment['dtype'], segment['numel'],
+                        segments)
+            segment['hash'] = '0'  # the hash of the grown segment is unknown
+        version = max(segment['version'] for segment in segments) + 1
+        for segment in segments:
+            segment['numel'] += len(frame)
+            segment['version'] = version
+            segment['sort_position'] = 0  # appended rows need not be in order
+    finally:
+        write_info(segments, info_file)
+
+    return dict((segment['varname'], (segment['key'], segment['segment_id'])) 
+                for segment in segments)
+
+def replace_columns(frame, info_file='segment_info.txt', key_seed=None):
+    """
+        Overwrite columns of the segments listed in an info file with the columns of a Pandas data
+        frame. Columns without a segment are written to new segments and added to the info file.
+        The frame must have as many rows as the segments
+
+        Arguments:
+            frame     -- the Pandas data frame holding the new columns
+            info_file -- a path to the file describing the segments, as written by write_frame().
+                         The file is rewritten with the new version (see note 7 above)
+            key_seed  -- the "initial" seed passed to "ftok()" for new columns. Required only if
+                         the frame has columns without a segment
+    """
+    segments = read_info(info_file)
+    check_in_memory(segments, info_file)
+    existing = dict((segment['varname'], segment) for segment in segments)
+    if len(segments) > 0 and len(frame) != segments[0]['numel']:
+        raise ValueError('Replaced columns must have as many rows as the segments in ' + info_file)
+
+    # check every column before any segment is modified
+    columns = []
+    for varname in frame.columns.tolist():
+        data = frame.loc[:,varname].values.tolist()
+        dtype = infer_dtype(data)
+        if dtype is None:
+            raise TypeError('Column: ' + varname + ' is of an unsupported type')
+        if varname not in existing and key_seed is None:
+            raise ValueError('A key_seed is required to add column: ' + varname)
+        columns.append((varname, data, DTYPE_CODES[dtype]))
+    check_unshared([existing[varname] for varname, data, dtype_key in columns 
+                    if varname in existing], segments, info_file)
+
+    version = max([segment['version'] for segment in segments] + [0]) + 1
+    try:
+        for varname, data, dtype_key in columns:
+            if varname in existing:
+                segment = existing[varname]
+                update_list(segment, data, dtype_key, 0, segments)
+                segment['dtype'] = dtype_key
+                segment['hash'] = '0'
+                if segment['sort_position'] > 0:
+                    for other in segments: other['sort_position'] = 0
+            else:
+                shm_key, segment_id, content_hash = _py_shm.write(data, dtype_key, key_seed)
+                key_seed += 1
+                segment = {'key' : shm_key, 'segment_id' : segment_id, 'dtype' : dtype_key,
+                           'numel' : len(data), 'varname' : varname, 'sort_position' : 0,
+                           'hash' : format_hash(content_hash), 'path' : '0', 'offset' : 0}
+                segments.append(segment)
+                cache_segment(segment)
+            segment['modified'] = version
+    finally:
+        for segment in segments: segment['version'] = version
+        write_info(segments, info_file)
+
+    return dict((segment['varname'], (segment['key'], segment['segment_id'])) 
+                for segment in segments)
+
+# utility function to write a list into the segment of an info file entry with _py_shm.update
+# and record its (possibly new) segment ID. If the update fails the segment may still have been
+# grown (before an element could not be converted, say) or restored under a new ID, which is
+# recorded before the error is raised. If it could not be restored it is lost and its entry is
+# removed from "segments"
+def update_list(segment, data, dtype_key, offset, segments):
+    forget_segment(segment)
+    try:
+        segment['key'], segment['segment_id'] = _py_shm.update(data, dtype_key, segment['key'],
+                                                               offset)
+    except Exception:
+        segment_stat = _py_shm.stat(segment['key'])
+        if segment_stat is None:
+            segments.remove(segment)
+        else:
+            segment['segment_id'] = segment_stat[0]
+        raise
+
+def write_matrix(matrix, name, key_seed, info_file='matrix_info.txt', order='C'):
+    """
+        Write a 2-D array to a shared memory segment (see note 9 above)
+
+        Arguments:
+            matrix    -- the matrix to be written. Anything Numpy can convert to a 2-D array of
+                         floats
+            name      -- the name of the matrix in info_file. "shm_matrix get" reads the matrix
+                         with this name
+            key_seed  -- an integer used in the "ftok()" function to obtain a key for shared memory
+            info_file -- a path to a file that will contain information about the segment allocated
+            order     -- 'C' to store the matrix row-major or 'F' to store it column-major
+    """
+    matrix = np.asarray(matrix, dtype=float)
+    if matrix.ndim != 2:
+        raise ValueError('Matrix must be two dimensional')
+    if order not in ('C', 'F'):
+        raise ValueError("Order must be 'C' (row-major) or 'F' (column-major)")
+
+    data = matrix.ravel(order=order).tolist()
+    shm_key, segment_id, content_hash = _py_shm.write(data, DTYPE_CODES['float'], key_seed)
+
+    with open(info_file, mode = 'ab') as fh:
+        fh.write('\t'.join(str(field) for field in 
+                 [shm_key, segment_id, matrix.shape[0], matrix.shape[1], order, name]) + '\n')
+
+    return (shm_key, segment_id)
+
+def read_matrix(name, info_file='matrix_info.txt'):
+    """
+        Read a matrix from a shared memory segment into a 2-D Numpy array (see note 9 above). If
+        info_file lists several matrices with the same name the last is read
+
+        Arguments:
+            name      -- the name of the matrix in info_file, as given to "shm_matrix put"
+            info_file -- a path to the file describing the matrix segment
+    """
+    matrices = []
+    with open(info_file, mode = 'rb') as fh:
+        for line in fh:
+            fields = line.rstrip('\r\n').split('\t')
+            if len(fields) == len(MATRIX_FIELDS) and fields[5] == name:
+                matrices.append(dict(zip(MATRIX_FIELDS, fields)))
+    if len(matrices) == 0:
+        raise KeyError('Matrix: ' + name + ' is not listed in ' + info_file)
+
+    matrix = matrices[-1]
+    rows, cols = int(matrix['rows']), int(matrix['cols'])
+    data = _py_shm.read(int(matrix['key']), rows * cols)
+    return np.array(data).reshape((rows, cols), order=matrix['order'])
+
+# utility function to read an info file into a list of dictionaries keyed by INFO_FIELDS. Fields
+# missing from files written by earlier versions default to 0 (a hash of 0 is unknown)
+def read_info(info_file):
+    segments = []
+    with open(info_file, mode = 'rb') as fh:
+        for line in fh:
+            fields = line.rstrip('\r\n').split('\t')
+            if len(fields) < 5: continue
+            fields += ['0'] * (len(INFO_FIELDS) - len(fields))
+            segment = dict(zip(INFO_FIELDS, fields))
+            for field in INFO_FIELDS:
+                if field not in ('varname', 'hash', 'path'): segment[field] = int(segment[field])
+            segments.append(segment)
+    return segments
+
+# utility function to check that the segments of an info file are in shared memory, as in-place
+# updates require
+def check_in_memory(segments, info_file):
+    if any(segment['path'] != '0' for segment in segments):
+        raise ValueError('Frames stored in files cannot be updated: ' + info_file)
+
+# utility function to check that none of "updated", segments listed in an info file, shares its
+# segment with another column of the file or of another info file known to the module (see note 8
+# above), as an update would then change those columns too
+def check_unshared(updated, segments, info_file):
+    for segment in updated:
+        shm_id = (segment['key'], segment['segment_id'])
+        if (sum((other['key'], other['segment_id']) == shm_id for other in segments) > 1 or 
+            listed_elsewhere(shm_id, info_file)):
+            raise ValueError('Column: ' + segment['varname'] + ' shares its segment with another ' 
+                             'column and cannot be updated in place')
+
+# utility function to check whether a segment is listed by a known info file other than info_file
+def listed_elsewhere(shm_id, info_file):
+    info_file = os.path.abspath(info_file)
+    return any(shm_id in listed for manifest, listed in _manifests.items() 
+               if manifest != info_file)
+
+# utility function to record the segments in shared memory listed by an info file
+def register_manifest(segments, info_file):
+    _manifests[os.path.abspath(info_file)] = set((segment['key'], segment['segment_id']) 
+                                                 for segment in segments if segment['path'] == '0')
+
+# utility function to replace the contents of an info file. The new file is written alongside the
+# old one and renamed over it so readers never see a partially written file
+def write_info(segments, info_file):
+    tmp_file = info_file + '.tmp'
+    with open(tmp_file, mode = 'wb') as fh:
+        for segment in segments: fh.write(format_info(segment))
+    os.rename(tmp_file, info_file)
+    register_manifest(segments, info_file)
+
+# utility function to format a line of an info file
+def format_info(segment):
+    return '\t'.join(str(segment[field]) for field in INFO_FIELDS) + '\n'
+
+# utility function to format a content hash returned by _py_shm as it is stored in an info file
+def format_hash(content_hash):
+    return '%016x' % content_hash
+
+# utility functions to add a segment to, and remove a segment from, the cache (see note 8 above)
+def cache_segment(segment):
+    if segment['hash'] != '0' and segment['path'] == '0':
+        cache_key = (segment['hash'], segment['dtype'], segment['numel'])
+        _column_cache[cache_key] = (segment['key'], segment['segment_id'])
+
+def forget_segment(segment):
+    for cache_key in [k for k, v in _column_cache.items() if v[0] == segment['key']]:
+        del _column_cache[cache_key]
+
 # utility function to remove an allocated segment
 def deallocate(segment_id):
     rc = os.system('ipcrm -m ' + str(segment_id))
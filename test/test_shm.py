@@ -1,4 +1,4 @@
-import unittest, os, sys
+import unittest, os, sys, mmap
 import pandas as pd
 import numpy  as np
 sys.path.append('../src')
@@ -25,6 +25,18 @@ class test(unittest.TestCase):
             os.unlink('segment_info.txt')
         if os.path.exists('../temp/test_segment_info.txt'):
             os.unlink('../temp/test_segment_info.txt')
+        if os.path.exists('../temp/test_sorted_segment_info.txt'):
+            os.unlink('../temp/test_sorted_segment_info.txt')
+        if os.path.exists('matrix_info.txt'):
+            os.unlink('matrix_info.txt')
+        if os.path.exists('../temp/test_matrix_info.txt'):
+            os.unlink('../temp/test_matrix_info.txt')
+        for filename in ['twins_info.txt', 'other_info.txt', 'frame.dat',
+                         '../temp/test_frame.dat', '../temp/test_file_info.txt',
+                         '../temp/test_update_info.txt', '../temp/test_update.dta',
+                         '../temp/update_from_stata.csv', '../temp/file_from_stata.csv']:
+            if os.path.exists(filename):
+                os.unlink(filename)
 
     def test_basic(self):
 
@@ -65,11 +77,167 @@ class test(unittest.TestCase):
         with self.assertRaises(TypeError):
             shm.write_frame(bad_data)
 
+    def test_sort(self):
+
+        # The permutation computed in C should match a stable sort in Pandas, with NaN last
+        keys = self.data.copy()
+        keys.loc[::7, 'float_var'] = np.nan
+        permutation = shm._py_shm.sort([keys['int_var'].values.tolist(), 
+                                        keys['float_var'].values.tolist()], [0, 1])
+        expected = keys.sort_values(['int_var', 'float_var'], kind='mergesort').index.tolist()
+        self.assertEqual(permutation, expected)
+
+        # Sorted frames are written in sorted order and their sort keys recorded
+        segments = shm.write_frame(self.data, sort_by=['int_var', 'float_var'])
+        for segment in segments: shm.deallocate(segments[segment][1])
+        info = pd.read_csv('segment_info.txt', sep='\t', header=None, index_col=4)
+        self.assertEqual(info.loc['int_var', 5], 1)
+        self.assertEqual(info.loc['float_var', 5], 2)
+
+        # Sorting by a column that does not exist should fail before anything is allocated
+        with self.assertRaises(KeyError):
+            shm.write_frame(self.data, sort_by=['missing_var'])
+
+    def test_update(self):
+
+        # Appending rows grows every segment and bumps the version
+        shm.write_frame(self.data.iloc[:10], sort_by=['int_var'])
+        shm.append_rows(self.data.iloc[10:1000])
+        info = shm.read_info('segment_info.txt')
+        self.assertEqual([segment['numel'] for segment in info], [1000, 1000])
+        self.assertEqual([segment['version'] for segment in info], [1, 1])
+        self.assertEqual([segment['sort_position'] for segment in info], [0, 0])
+
+        # Appended rows must match the columns and types of the segments
+        with self.assertRaises(KeyError):
+            shm.append_rows(self.data.loc[:, ['float_var']])
+        with self.assertRaises(TypeError):
+            shm.append_rows(self.data.loc[:, ['int_var', 'float_var']].astype(float))
+
+        # Replacing columns marks them modified; new columns need a seed
+        new_columns = pd.DataFrame({'int_var' : np.arange(1000), 'new_var' : np.ones(1000)})
+        with self.assertRaises(ValueError):
+            shm.replace_columns(new_columns)
+        segments = shm.replace_columns(new_columns, key_seed=3)
+        info = dict((segment['varname'], segment) for segment in shm.read_info('segment_info.txt'))
+        self.assertEqual(info['float_var']['modified'], 0)
+        self.assertEqual(info['int_var']['modified'], 2)
+        self.assertEqual(info['new_var']['modified'], 2)
+        self.assertEqual(info['new_var']['version'], 2)
+
+        # Segment IDs reported after an update are current and can be deallocated
+        for segment in segments: shm.deallocate(segments[segment][1])
+
+    def test_cache(self):
+
+        # Hashing a column in C gives the hash recorded when it is written
+        int_data = self.data['int_var'].values.tolist()
+        int_segment = shm._py_shm.write(int_data, 0, 1)
+        self.assertEqual(int_segment[2], shm._py_shm.hash(int_data, 0))
+        shm.deallocate(int_segment[1])
+
+        # Re-exporting a frame reuses the segments of unchanged columns
+        first = shm.write_frame(self.data, use_cache=True)
+        changed = self.data.copy()
+        changed.loc[0, 'float_var'] = -1.0
+        second = shm.write_frame(changed, use_cache=True)
+        self.assertEqual(first['int_var'], second['int_var'])
+        self.assertNotEqual(first['float_var'], second['float_var'])
+        self.assertEqual(len(shm.read_info('segment_info.txt')), 2)
+
+        # ... and frees the old segments of changed columns
+        self.assertIsNone(shm._py_shm.stat(first['float_var'][0]))
+
+        # A call which fails leaves the info file, and the segments it lists, untouched
+        with self.assertRaises(KeyError):
+            shm.write_frame(changed, use_cache=True, sort_by=['no_such_var'])
+        self.assertEqual(len(shm.read_info('segment_info.txt')), 2)
+
+        # Deallocated segments are detected and written again
+        shm.deallocate(second['int_var'][1])
+        third = shm.write_frame(changed, use_cache=True)
+        self.assertNotEqual(second['int_var'], third['int_var'])
+        self.assertEqual(second['float_var'], third['float_var'])
+
+        for segment_info in [third['float_var'], third['int_var']]:
+            shm.deallocate(segment_info[1])
+
+        # Identical columns of a frame never share a segment, but frames may share segments, which
+        # are then not updated in place
+        twins = pd.DataFrame({'a' : self.float_variable, 'b' : self.float_variable})
+        twin_segments = shm.write_frame(twins, info_file='twins_info.txt', key_seed=20,
+                                        use_cache=True)
+        self.assertNotEqual(twin_segments['a'], twin_segments['b'])
+        shm.write_frame(twins[['a']], info_file='other_info.txt', key_seed=30, use_cache=True)
+        with self.assertRaises(ValueError):
+            shm.append_rows(twins, info_file='twins_info.txt')
+
+        for segment_info in twin_segments.values():
+            shm.deallocate(segment_info[1])
+
+    def test_matrix(self):
+
+        # Matrices come back as they were written in either storage order, NaN included
+        matrix = np.random.rand(300, 40)
+        matrix[3, 4] = np.nan
+        row_major = shm.write_matrix(matrix, 'row_major', 1)
+        col_major = shm.write_matrix(matrix, 'col_major', 2, order='F')
+        np.testing.assert_array_equal(shm.read_matrix('row_major'), matrix)
+        np.testing.assert_array_equal(shm.read_matrix('col_major'), matrix)
+        shm.deallocate(row_major[1])
+        shm.deallocate(col_major[1])
+
+        # Only 2-D arrays can be written, and only listed matrices read
+        with self.assertRaises(ValueError):
+            shm.write_matrix(np.arange(3), 'vector', 1)
+        with self.assertRaises(KeyError):
+            shm.read_matrix('missing_matrix')
+
+    def test_file(self):
+
+        # Frames stored in files lay columns out at page aligned offsets, as in a segment. The
+        # segments listed in the info file the frame replaces are deallocated
+        segments = shm.write_frame(self.data)
+        columns = shm.write_frame(self.data, path='frame.dat')
+        for segment_info in segments.values():
+            self.assertIsNone(shm._py_shm.stat(segment_info[0]))
+        offsets = sorted(offset for path, offset in columns.values())
+        self.assertEqual(offsets, [0, shm.page_align(8 * len(self.data))])
+        self.assertEqual(os.path.getsize('frame.dat'), offsets[1] + 8 * len(self.data))
+
+        info = shm.read_info('segment_info.txt')
+        self.assertEqual([segment['path'] for segment in info], [os.path.abspath('frame.dat')] * 2)
+        self.assertEqual([segment['key'] for segment in info], [0, 0])
+
+        # Writing the frame again replaces both the file and the info file
+        shm.write_frame(self.data.iloc[:10], path='frame.dat')
+        self.assertEqual(len(shm.read_info('segment_info.txt')), 2)
+        self.assertEqual(os.path.getsize('frame.dat'), mmap.PAGESIZE + 80)
+        self.assertFalse(os.path.exists('frame.dat.tmp'))
+
+        # Frames stored in files cannot be updated in place or use the cache
+        with self.assertRaises(ValueError):
+            shm.append_rows(self.data)
+        with self.assertRaises(ValueError):
+            shm.write_frame(self.data, path='frame.dat', use_cache=True)
+
     def test_stata(self):
 
         # Test writing to Stata
         stata_segment = shm.write_frame(self.data, info_file = '../temp/test_segment_info.txt')
-        rc = os.system('stata-mp test_shm.do')
+        sorted_frame = self.data.copy()
+        sorted_frame.loc[::1000, 'float_var'] = np.nan
+        sorted_segment = shm.write_frame(sorted_frame, key_seed = 3,
+                                         sort_by = ['int_var', 'float_var'],
+                                         info_file = '../temp/test_sorted_segment_info.txt')
+        file_segment = shm.write_frame(self.data, path = '../temp/test_frame.dat',
+                                       info_file = '../temp/test_file_info.txt')
+        update_frame = self.data.iloc[:1000].reset_index(drop=True)
+        update_segment = shm.write_frame(update_frame, key_seed = 7,
+                                         info_file = '../temp/test_update_info.txt')
+        matrix = np.random.rand(200, 30)
+        matrix_segment = shm.write_matrix(matrix, 'M', 5, info_file = '../temp/test_matrix_info.txt')
+        rc = os.system('stata-mp -b do test_shm.do')
         self.assertTrue(rc == 0)
 
         stata_results = pd.read_csv('../temp/results_from_stata.csv')
@@ -84,5 +252,35 @@ class test(unittest.TestCase):
         int_diff = (stata_results['int_var'] - self.data['int_var']).abs()
         self.assertTrue(int_diff.max() == 0)
 
+        # frames stored in files should be loaded exactly as frames in shared memory are
+        file_results = pd.read_csv('../temp/file_from_stata.csv')
+        float_diff = (file_results['float_var'] - self.data['float_var']).abs()
+        self.assertTrue(float_diff.max() < 2.25e-16)
+        int_diff = (file_results['int_var'] - self.data['int_var']).abs()
+        self.assertTrue(int_diff.max() == 0)
+
+        # matrices should make the round trip through Stata unchanged
+        from_stata = shm.read_matrix('M_from_stata', '../temp/test_matrix_info.txt')
+        np.testing.assert_array_equal(from_stata, matrix)
+        with open('../temp/test_matrix_info.txt') as fh:
+            shm.deallocate(fh.readlines()[-1].split('\t')[1])
+
+        # shm_use, update should load the rows appended and the column replaced since the frame
+        # was loaded (see test_update_load and test_update in test_shm.do)
+        appended = self.data.iloc[1000:1500].reset_index(drop=True)
+        shm.append_rows(appended, info_file = '../temp/test_update_info.txt')
+        updated = pd.concat([update_frame, appended], ignore_index = True)
+        updated['float_var'] = np.random.rand(1500)
+        shm.replace_columns(updated[['float_var']], info_file = '../temp/test_update_info.txt')
+        rc = os.system('stata-mp -b do test_shm.do update')
+        self.assertTrue(rc == 0)
+
+        update_results = pd.read_csv('../temp/update_from_stata.csv')
+        self.assertEqual(len(update_results), 1500)
+        float_diff = (update_results['float_var'] - updated['float_var']).abs()
+        self.assertTrue(float_diff.max() < 2.25e-16)
+        int_diff = (update_results['int_var'] - updated['int_var']).abs()
+        self.assertTrue(int_diff.max() == 0)
+
 if __name__=='__main__':
     unittest.main()